@@ -1,6 +1,7 @@
 #include "nbtty.h"
 #include "ansi.h"
 
+#include <stdio.h>
 #include <string.h>
 
 /*
@@ -25,6 +26,9 @@ struct ansi_parser {
     int col;
 
     struct winsize ws;
+
+    /* Set when a window size report is parsed even if the size didn't change */
+    int got_report;
 };
 static struct ansi_parser ansi_parser;
 
@@ -75,6 +79,7 @@ static void ansi_handle_rc(unsigned char in, unsigned char **out)
     ansi_parser.ws.ws_col = ansi_parser.col;
     ansi_parser.ws.ws_xpixel = 0;
     ansi_parser.ws.ws_ypixel = 0;
+    ansi_parser.got_report = 1;
 
     // Discard ANSI code
     ansi_parser.index = 0;
@@ -147,8 +152,8 @@ int ansi_process_input(const unsigned char *input, size_t input_size,
     *output_size = (size_t) (out - output);
 
     if (ansi_parser.ws.ws_col != 0 &&
-            ansi_parser.ws.ws_col != ws->ws_col &&
-            ansi_parser.ws.ws_row != ws->ws_row) {
+            (ansi_parser.ws.ws_col != ws->ws_col ||
+             ansi_parser.ws.ws_row != ws->ws_row)) {
         *ws = ansi_parser.ws;
         return 1;
     } else {
@@ -156,6 +161,26 @@ int ansi_process_input(const unsigned char *input, size_t input_size,
     }
 }
 
+/**
+ * Return whether a window size report was received since the last call.
+ */
+int ansi_size_report_received()
+{
+    int received = ansi_parser.got_report;
+    ansi_parser.got_report = 0;
+    return received;
+}
+
+/**
+ * Format a window size report like the one a terminal sends in response
+ * to the request. Returns the length.
+ */
+size_t ansi_size_report(unsigned char *dest, size_t len, const struct winsize *ws)
+{
+    int n = snprintf((char *) dest, len, ESC"[%u;%uR", ws->ws_row, ws->ws_col);
+    return n < 0 || (size_t) n >= len ? 0 : (size_t) n;
+}
+
 void ansi_reset_parser()
 {
     memset(&ansi_parser, 0, sizeof(ansi_parser));
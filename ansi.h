@@ -5,10 +5,13 @@
 #include <sys/ioctl.h>
 
 #define ANSI_MAX_RESPONSE_LEN 10 /* The max size of the response and +1 the size that could be buffered */
+#define ANSI_MAX_REQUEST_LEN 32  /* The max size of the window size request */
 
 int ansi_process_input(const unsigned char *input, size_t input_size,
                        unsigned char *output, size_t *output_size, struct winsize *ws);
 size_t ansi_size_request(unsigned char *dest);
+int ansi_size_report_received();
+size_t ansi_size_report(unsigned char *dest, size_t len, const struct winsize *ws);
 void ansi_reset_parser();
 
 #endif // ANSI_H
@@ -17,6 +17,7 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 #include "nbtty.h"
+#include "ansi.h"
 
 #include <err.h>
 #include <fcntl.h>
@@ -27,6 +28,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <termios.h>
 #include <unistd.h>
 
@@ -48,6 +51,12 @@ static int tty_out = STDOUT_FILENO;
 
 static int terminal_active = 1;
 
+/* Set by SIGWINCH */
+static volatile sig_atomic_t window_changed = 0;
+
+/* Set by SIGUSR1 when the master wants queued output thrown away */
+static volatile sig_atomic_t flush_requested = 0;
+
 /* Ignore the return code of write. This works around a compiler warning */
 static ssize_t write_buffer(int fd, const unsigned char *buffer, size_t len)
 {
@@ -57,6 +66,12 @@ static ssize_t write_buffer(int fd, const unsigned char *buffer, size_t len)
         return (ssize_t) len;
 }
 
+/* Like write_buffer, but also writes when the terminal isn't active */
+static ssize_t write_always(int fd, const unsigned char *buffer, size_t len)
+{
+    return write(fd, buffer, len);
+}
+
 static ssize_t write_string(int fd, const char *str)
 {
     return write_buffer(fd, (const unsigned char *) str, strlen(str));
@@ -80,6 +95,45 @@ static void die(int sig)
     exit(EXIT_FAILURE);
 }
 
+static void winch(int sig)
+{
+    (void) sig;
+    window_changed = 1;
+}
+
+static void flush(int sig)
+{
+    (void) sig;
+    flush_requested = 1;
+}
+
+/* Throw away output that's queued in the socket and in the tty */
+static void flush_output(int s)
+{
+    unsigned char buf[BUFSIZE];
+    while (recv(s, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+
+    tcflush(tty_out, TCOFLUSH);
+}
+
+/* If the tty knows its size, send it to the master in the same form as a
+** reply to the ANSI window size request. The master stops probing when it
+** sees these. Serial ports report 0x0, so nothing is sent for them. */
+static void send_window_size(int s)
+{
+    struct winsize ws;
+    if (ioctl(tty_in, TIOCGWINSZ, &ws) < 0 ||
+            ws.ws_row == 0 || ws.ws_row > 999 ||
+            ws.ws_col == 0 || ws.ws_col > 999)
+        return;
+
+    unsigned char report[ANSI_MAX_RESPONSE_LEN * 2];
+    size_t len = ansi_size_report(report, sizeof(report), &ws);
+    if (len > 0)
+        write_always(s, report, len);
+}
+
 static void open_tty(const char *ttypath)
 {
     // If already open, the close the handle.
@@ -91,7 +145,9 @@ static void open_tty(const char *ttypath)
         tty_in = STDIN_FILENO;
         tty_out = STDOUT_FILENO;
     } else {
-        // Open the tty or retry until it works
+        // Open the tty or retry until it works. Retry quickly at first
+        // since the tty usually shows up soon after boot.
+        useconds_t delay = 10000;
         for (;;) {
             int fd = open(ttypath, O_RDWR | O_CLOEXEC);
             if (fd >= 0) {
@@ -100,8 +156,9 @@ static void open_tty(const char *ttypath)
                 break;
             }
 
-            // Try again in a second?
-            sleep(1);
+            usleep(delay);
+            if (delay < 1000000)
+                delay *= 2;
         }
     }
 
@@ -134,14 +191,36 @@ int attach_main(int s, const char *ttypath, int wait_input)
     signal(SIGTERM, die);
     signal(SIGINT, die);
     signal(SIGQUIT, die);
+    signal(SIGWINCH, winch);
+    /* SIGUSR2 is for the master, so don't die if it gets sent here too */
+    signal(SIGUSR2, SIG_IGN);
+
+    /* Don't restart writes to the tty after a flush request, since what's
+    ** left to write is being thrown away. */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = flush;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
 
     open_tty(ttypath);
+    send_window_size(s);
 
     /* Set a trap to restore the terminal when we die. */
     atexit(restore_term);
 
     /* Wait for things to happen */
     for (;;) {
+        if (flush_requested) {
+            flush_requested = 0;
+            flush_output(s);
+        }
+
+        if (window_changed) {
+            window_changed = 0;
+            send_window_size(s);
+        }
+
         unsigned char buf[BUFSIZE];
         fd_set readfds;
         FD_ZERO(&readfds);
@@ -179,6 +258,7 @@ int attach_main(int s, const char *ttypath, int wait_input)
                 if (tty_in == STDIN_FILENO)
                     exit(EXIT_FAILURE);
                 open_tty(ttypath);
+                send_window_size(s);
                 continue;
             }
 
@@ -0,0 +1,307 @@
+/*
+    nbtty - A subset of dtach that makes the terminal nonblocking
+    Copyright (C) 2017 Frank Hunleth
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "nbtty.h"
+#include "filter.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+
+/*
+ * Lines of output that contain any of the patterns are dropped. Patterns
+ * are literal strings. A leading '^' anchors a pattern to the start of
+ * the line. Use "\^" to match a literal '^' at the start.
+ *
+ * All patterns are compiled into one Aho-Corasick automaton with every
+ * transition filled in, so each byte of output costs one table lookup.
+ * Bytes that don't appear in any pattern share one character class to
+ * keep the table small. The start of a line is fed to the automaton as
+ * its own character class so that anchored patterns can be part of the
+ * same automaton.
+ *
+ * Lines are held until they're known not to match. If a partial line sits
+ * around for too long (like a prompt), it's sent and the rest of the line
+ * isn't filtered.
+ */
+#define CLASS_BOL   0
+#define CLASS_OTHER 1
+
+struct filter_pattern {
+    const char *text;
+    size_t len;
+    int anchored;
+    unsigned long dropped;
+};
+
+struct filter {
+    struct filter_pattern patterns[FILTER_MAX_PATTERNS];
+    int num_patterns;
+
+    /* Automaton */
+    uint16_t char_class[256];
+    int num_classes;
+    int num_states;
+    uint16_t *next; /* next[state * num_classes + class] */
+    uint8_t *match; /* pattern number + 1 that matches at a state or 0 */
+
+    /* Current line */
+    uint16_t state;
+    int dropping;
+    int passing;
+    unsigned char held[FILTER_MAX_HELD];
+    size_t held_len;
+    unsigned long lines;
+};
+static struct filter filter;
+
+/**
+ * Add a pattern. The string must stay around.
+ */
+int filter_add(const char *pattern)
+{
+    if (filter.num_patterns == FILTER_MAX_PATTERNS) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    struct filter_pattern *p = &filter.patterns[filter.num_patterns];
+    p->anchored = 0;
+    if (pattern[0] == '^') {
+        p->anchored = 1;
+        pattern++;
+    } else if (pattern[0] == '\\' && pattern[1] == '^') {
+        pattern++;
+    }
+
+    p->text = pattern;
+    p->len = strlen(pattern);
+    p->dropped = 0;
+    if (p->len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    filter.num_patterns++;
+    return 0;
+}
+
+static void start_line()
+{
+    filter.state = filter.next[CLASS_BOL];
+    filter.dropping = 0;
+    filter.passing = 0;
+    filter.held_len = 0;
+    filter.lines++;
+}
+
+/**
+ * Build the automaton from the added patterns.
+ */
+int filter_compile()
+{
+    if (filter.num_patterns == 0)
+        return 0;
+
+    /* Assign character classes */
+    filter.num_classes = CLASS_OTHER + 1;
+    for (int i = 0; i < 256; i++)
+        filter.char_class[i] = CLASS_OTHER;
+    int num_states = 1;
+    for (int i = 0; i < filter.num_patterns; i++) {
+        const struct filter_pattern *p = &filter.patterns[i];
+        for (size_t j = 0; j < p->len; j++) {
+            unsigned char c = p->text[j];
+            if (filter.char_class[c] == CLASS_OTHER)
+                filter.char_class[c] = filter.num_classes++;
+        }
+        num_states += p->len + p->anchored;
+    }
+    if (num_states > UINT16_MAX) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    /* Build the trie. 0 means no transition since nothing goes back to
+    ** the root in a trie. */
+    size_t table_size = (size_t) num_states * filter.num_classes;
+    filter.next = calloc(table_size, sizeof(uint16_t));
+    filter.match = calloc(num_states, sizeof(uint8_t));
+    uint16_t *fail = calloc(num_states, sizeof(uint16_t));
+    uint16_t *queue = malloc(num_states * sizeof(uint16_t));
+    if (!filter.next || !filter.match || !fail || !queue) {
+        free(fail);
+        free(queue);
+        return -1;
+    }
+
+    filter.num_states = 1;
+    for (int i = 0; i < filter.num_patterns; i++) {
+        const struct filter_pattern *p = &filter.patterns[i];
+        uint16_t state = 0;
+        for (size_t j = (p->anchored ? 0 : 1); j <= p->len; j++) {
+            int cls = j == 0 ? CLASS_BOL : filter.char_class[(unsigned char) p->text[j - 1]];
+            uint16_t *t = &filter.next[state * filter.num_classes + cls];
+            if (*t == 0)
+                *t = filter.num_states++;
+            state = *t;
+        }
+        if (filter.match[state] == 0)
+            filter.match[state] = i + 1;
+    }
+
+    /* Fill in the missing transitions breadth first from the failure links */
+    int head = 0;
+    int tail = 0;
+    for (int cls = 0; cls < filter.num_classes; cls++) {
+        uint16_t s = filter.next[cls];
+        if (s) {
+            fail[s] = 0;
+            queue[tail++] = s;
+        }
+    }
+    while (head < tail) {
+        uint16_t state = queue[head++];
+        if (filter.match[state] == 0)
+            filter.match[state] = filter.match[fail[state]];
+
+        for (int cls = 0; cls < filter.num_classes; cls++) {
+            uint16_t *t = &filter.next[state * filter.num_classes + cls];
+            uint16_t f = filter.next[fail[state] * filter.num_classes + cls];
+            if (*t) {
+                fail[*t] = f;
+                queue[tail++] = *t;
+            } else {
+                *t = f;
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+
+    start_line();
+    return 0;
+}
+
+int filter_enabled()
+{
+    return filter.next != NULL;
+}
+
+/**
+ * Remove matching lines from the input. The output buffer must hold
+ * input_size + FILTER_MAX_HELD bytes. Returns the number of bytes output.
+ */
+size_t filter_process(const unsigned char *input, size_t input_size, unsigned char *output)
+{
+    const unsigned char *ip = input;
+    const unsigned char *iend = input + input_size;
+    unsigned char *op = output;
+
+    while (ip < iend) {
+        if (filter.dropping || filter.passing) {
+            const unsigned char *eol = memchr(ip, '\n', iend - ip);
+            const unsigned char *end = eol ? eol + 1 : iend;
+            if (filter.passing) {
+                memcpy(op, ip, end - ip);
+                op += end - ip;
+            }
+            ip = end;
+            if (eol)
+                start_line();
+            continue;
+        }
+
+        unsigned char c = *ip++;
+        filter.held[filter.held_len++] = c;
+        if (c == '\n') {
+            memcpy(op, filter.held, filter.held_len);
+            op += filter.held_len;
+            start_line();
+            continue;
+        }
+
+        filter.state = filter.next[filter.state * filter.num_classes + filter.char_class[c]];
+        uint8_t m = filter.match[filter.state];
+        if (m) {
+            filter.patterns[m - 1].dropped++;
+            filter.dropping = 1;
+            filter.held_len = 0;
+        } else if (filter.held_len == sizeof(filter.held)) {
+            /* Too long to hold onto */
+            op += filter_flush(op);
+        }
+    }
+    return (size_t) (op - output);
+}
+
+/**
+ * Return the number of bytes in a partial line being held.
+ */
+size_t filter_held()
+{
+    return filter.held_len;
+}
+
+/**
+ * Return a count that changes each time a new line is started. This tells
+ * if the partial line being held is a different one than before.
+ */
+unsigned long filter_lines()
+{
+    return filter.lines;
+}
+
+/**
+ * Output the partial line being held. The rest of the line will be
+ * passed through unfiltered. Returns the number of bytes.
+ */
+size_t filter_flush(unsigned char *output)
+{
+    size_t len = filter.held_len;
+    if (len > 0) {
+        memcpy(output, filter.held, len);
+        filter.held_len = 0;
+        filter.passing = 1;
+    }
+    return len;
+}
+
+/**
+ * Throw away the partial line being held. The rest of the line is
+ * filtered as if it were a new one.
+ */
+void filter_discard()
+{
+    if (filter_enabled())
+        start_line();
+}
+
+/**
+ * Log how many lines each pattern dropped.
+ */
+void filter_report()
+{
+    for (int i = 0; i < filter.num_patterns; i++) {
+        const struct filter_pattern *p = &filter.patterns[i];
+        syslog(LOG_INFO, "filter %s%s dropped %lu lines",
+               p->anchored ? "^" : "", p->text, p->dropped);
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdlib.h>
+
+#define FILTER_MAX_PATTERNS 32
+
+/* Partial lines are held at most this long waiting for the rest */
+#define FILTER_IDLE_MS 20
+
+/* Output from filter_process() can be up to this much more than the input */
+#define FILTER_MAX_HELD BUFSIZE
+
+int filter_add(const char *pattern);
+int filter_compile();
+int filter_enabled();
+
+size_t filter_process(const unsigned char *input, size_t input_size, unsigned char *output);
+size_t filter_held();
+unsigned long filter_lines();
+size_t filter_flush(unsigned char *output);
+void filter_discard();
+
+void filter_report();
+
+#endif // FILTER_H
@@ -0,0 +1,193 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * This is a small LZ77 compressor that uses the LZ4 block format. It
+ * trades compression ratio for speed and tiny memory use, since it only
+ * runs on console output.
+ *
+ * Each sequence is a token byte with the literal length in the high nibble
+ * and the match length minus LZ_MIN_MATCH in the low nibble. A nibble of 15
+ * means that more length bytes follow and are added until one isn't 255.
+ * The literals come next and then a 16-bit little endian offset back to
+ * the match. The last sequence only has literals.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+/* Positions of recently seen 4 byte sequences */
+static uint16_t lz_table[1 << LZ_HASH_BITS];
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned int lz_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Worst case number of bytes to encode a length beyond its nibble */
+static size_t extra_length_bytes(size_t len)
+{
+    return len >= 15 ? (len - 15) / 255 + 1 : 0;
+}
+
+static unsigned char *put_extra_length(unsigned char *op, size_t len)
+{
+    if (len >= 15) {
+        len -= 15;
+        while (len >= 255) {
+            *op++ = 255;
+            len -= 255;
+        }
+        *op++ = (unsigned char) len;
+    }
+    return op;
+}
+
+/* Emit one sequence. Returns NULL if the output is too small. */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend,
+                                   const unsigned char *literals, size_t literal_len,
+                                   size_t offset, size_t match_len)
+{
+    size_t match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+    size_t needed = 1 + extra_length_bytes(literal_len) + literal_len +
+                    (match_len ? 2 + extra_length_bytes(match_code) : 0);
+    if (needed > (size_t) (oend - op))
+        return NULL;
+
+    *op++ = (unsigned char) (((literal_len < 15 ? literal_len : 15) << 4) |
+                             (match_code < 15 ? match_code : 15));
+    op = put_extra_length(op, literal_len);
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+
+    if (match_len) {
+        *op++ = offset & 0xff;
+        *op++ = (offset >> 8) & 0xff;
+        op = put_extra_length(op, match_code);
+    }
+    return op;
+}
+
+/**
+ * Compress input into output. Returns the compressed size or 0 if it
+ * wouldn't fit. Callers should store the input uncompressed in that case.
+ */
+size_t lz_compress(const unsigned char *input, size_t input_size,
+                   unsigned char *output, size_t output_size)
+{
+    if (input_size > LZ_MAX_INPUT)
+        return 0;
+
+    memset(lz_table, 0, sizeof(lz_table));
+
+    unsigned char *op = output;
+    unsigned char *oend = output + output_size;
+    size_t anchor = 0;
+    size_t i = 0;
+
+    /* Matches stop short of the end so that the last bytes are literals */
+    size_t limit = input_size > LZ_LAST_LITERALS ? input_size - LZ_LAST_LITERALS : 0;
+    while (i + LZ_MIN_MATCH <= limit) {
+        uint32_t seq = read32(&input[i]);
+        unsigned int h = lz_hash(seq);
+        size_t ref = lz_table[h];
+        lz_table[h] = (uint16_t) i;
+
+        if (ref >= i || i - ref > LZ_MAX_OFFSET || read32(&input[ref]) != seq) {
+            i++;
+            continue;
+        }
+
+        size_t match_len = LZ_MIN_MATCH;
+        while (i + match_len < limit && input[ref + match_len] == input[i + match_len])
+            match_len++;
+
+        op = put_sequence(op, oend, &input[anchor], i - anchor, i - ref, match_len);
+        if (op == NULL)
+            return 0;
+
+        i += match_len;
+        anchor = i;
+    }
+
+    op = put_sequence(op, oend, &input[anchor], input_size - anchor, 0, 0);
+    if (op == NULL)
+        return 0;
+
+    return (size_t) (op - output);
+}
+
+static int get_extra_length(const unsigned char **ip, const unsigned char *iend, size_t *len)
+{
+    if (*len != 15)
+        return 0;
+
+    for (;;) {
+        if (*ip >= iend)
+            return -1;
+        unsigned char b = *(*ip)++;
+        *len += b;
+        if (b != 255)
+            return 0;
+    }
+}
+
+/**
+ * Decompress input into output. Returns the decompressed size or -1 if the
+ * input is corrupt or output_size is too small.
+ */
+int lz_decompress(const unsigned char *input, size_t input_size,
+                  unsigned char *output, size_t output_size)
+{
+    const unsigned char *ip = input;
+    const unsigned char *iend = input + input_size;
+    unsigned char *op = output;
+    unsigned char *oend = output + output_size;
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+
+        size_t literal_len = token >> 4;
+        if (get_extra_length(&ip, iend, &literal_len) < 0 ||
+                literal_len > (size_t) (iend - ip) ||
+                literal_len > (size_t) (oend - op))
+            return -1;
+        memcpy(op, ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+
+        /* The last sequence doesn't have a match */
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - output))
+            return -1;
+
+        size_t match_len = token & 0xf;
+        if (get_extra_length(&ip, iend, &match_len) < 0)
+            return -1;
+        match_len += LZ_MIN_MATCH;
+        if (match_len > (size_t) (oend - op))
+            return -1;
+
+        /* Byte by byte since the match may overlap what's being written */
+        const unsigned char *match = op - offset;
+        while (match_len--)
+            *op++ = *match++;
+    }
+    return (int) (op - output);
+}
@@ -0,0 +1,14 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdlib.h>
+
+/* Inputs to lz_compress() can't be larger than this */
+#define LZ_MAX_INPUT 65536
+
+size_t lz_compress(const unsigned char *input, size_t input_size,
+                   unsigned char *output, size_t output_size);
+int lz_decompress(const unsigned char *input, size_t input_size,
+                  unsigned char *output, size_t output_size);
+
+#endif // LZ_H
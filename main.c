@@ -17,6 +17,9 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 #include "nbtty.h"
+#include "filter.h"
+#include "scrollback.h"
+#include "trace.h"
 
 #include <err.h>
 #include <getopt.h>
@@ -31,24 +34,49 @@
 /* Make sure the binary has a copyright. */
 const char copyright[] = "nbtty - version 0.3.0 (C)Copyright 2004-2016 Ned T. Crigler, 2017 Frank Hunleth";
 
+struct timespec start_time;
+int report_startup_time = 0;
+
 static void usage()
 {
-    errx(EXIT_FAILURE, "nbtty [--tty <path>|--wait-input] <command> [args...]");
+    errx(EXIT_FAILURE, "nbtty [--tty <path>|--wait-input] [--record <trace>] [--report-startup]\n"
+                       "             [--filter <pattern>]...\n"
+                       "             [--scrollback <bytes> [--scrollback-socket <path>] [--scrollback-dump <path>]]\n"
+                       "             <command> [args...]\n"
+                       "       nbtty --replay <trace> [--replay-fast] [--drain-rate <bytes/s>]");
 }
 
 int main(int argc, char **argv)
 {
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
     const char *ttypath = NULL;
     int wait_input = 0;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    int replay_realtime = 1;
+    unsigned long drain_rate = 0;
+    size_t scrollback_size = 0;
+    const char *scrollback_socket = NULL;
+    const char *scrollback_dump = NULL;
 
     for (;;) {
         static struct option long_options[] = {
             {"tty",     required_argument, 0,  't' },
             {"wait-input",  no_argument,   0,  'w' },
+            {"record",  required_argument, 0,  'r' },
+            {"replay",  required_argument, 0,  'R' },
+            {"replay-fast", no_argument,   0,  'f' },
+            {"drain-rate", required_argument, 0, 'd' },
+            {"report-startup", no_argument, 0, 's' },
+            {"scrollback", required_argument, 0, 'b' },
+            {"scrollback-socket", required_argument, 0, 'S' },
+            {"scrollback-dump", required_argument, 0, 'D' },
+            {"filter", required_argument, 0, 'F' },
             {0,         0,                 0,  0 }
         };
 
-        int c = getopt_long(argc, argv, "+tw", long_options, NULL);
+        int c = getopt_long(argc, argv, "+twr:R:fd:sb:S:D:F:", long_options, NULL);
         if (c == -1)
             break;
 
@@ -60,14 +88,65 @@ int main(int argc, char **argv)
         case 'w':
             wait_input = 1;
             break;
+
+        case 'r':
+            record_path = optarg;
+            break;
+
+        case 'R':
+            replay_path = optarg;
+            break;
+
+        case 'f':
+            replay_realtime = 0;
+            break;
+
+        case 'd':
+            drain_rate = strtoul(optarg, NULL, 0);
+            break;
+
+        case 's':
+            report_startup_time = 1;
+            break;
+
+        case 'b':
+            scrollback_size = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'S':
+            scrollback_socket = optarg;
+            break;
+
+        case 'D':
+            scrollback_dump = optarg;
+            break;
+
+        case 'F':
+            if (filter_add(optarg) < 0)
+                err(EXIT_FAILURE, "--filter %s", optarg);
+            break;
+
         default:
             usage();
         }
      }
 
+    if (filter_compile() < 0)
+        err(EXIT_FAILURE, "--filter");
+
+    if (replay_path)
+        return replay_main(replay_path, replay_realtime, drain_rate);
+
     if (optind == argc)
         usage();
 
+    if (record_path && trace_open(record_path) < 0)
+        err(EXIT_FAILURE, "%s", record_path);
+
+    if (scrollback_size &&
+            scrollback_init(scrollback_size, scrollback_socket, scrollback_dump) < 0)
+        err(EXIT_FAILURE, "scrollback");
+
     int sv[2];
     if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
         err(EXIT_FAILURE, "socketpair");
@@ -76,6 +155,7 @@ int main(int argc, char **argv)
         return 1;
 
     close(sv[0]);
+    trace_close();
 
     return attach_main(sv[1], ttypath, wait_input);
 }
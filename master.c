@@ -18,12 +18,16 @@
 */
 #include "nbtty.h"
 #include "ansi.h"
+#include "filter.h"
+#include "scrollback.h"
+#include "trace.h"
 
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <pty.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -44,6 +48,8 @@ struct pty {
     pid_t pid;
     /* The current window size of the pty. */
     struct winsize ws;
+    /* Non-zero if reads from the pty start with a TIOCPKT status byte. */
+    int packet_mode;
 };
 
 /* The connected client. */
@@ -51,22 +57,83 @@ static int client_fd = -1;
 
 /* The pseudo-terminal created for the child process. */
 static struct pty the_pty;
-static uint32_t next_poll_time = 0;
 
-/* This gets set to true when it's time to poll the window size again */
-static int poll_window_size = 0;
+/* Set if the pty was made, but the program couldn't be started */
+static int spawn_failed = 0;
+
+/*
+** Window size probing - The request is only sent when nothing else is
+** queued for the client so that it doesn't get mixed up with or dropped
+** along with the program's output. If the terminal doesn't reply, the
+** request is retried. Probes are spaced further apart while the size
+** stays the same or while the terminal doesn't answer at all. If a size
+** report shows up before anything was asked, the client is pushing size
+** changes on its own and probing stops.
+*/
+#define PROBE_MIN_INTERVAL_MS 5000
+#define PROBE_MAX_INTERVAL_MS 60000
+#define PROBE_REPLY_TIMEOUT_MS 1000
+#define PROBE_QUEUE_CHECK_MS 50
+#define PROBE_MAX_RETRIES 3
+
+enum probe_state {
+    PROBE_IDLE,   /* Nothing to do */
+    PROBE_WANTED, /* Waiting for the client queue to empty */
+    PROBE_SENT    /* Waiting for the reply */
+};
+
+static struct {
+    enum probe_state state;
+    int retries;
+    int sent;
+    uint32_t interval;
+    uint32_t next_time;
+    uint32_t deadline;
+    int disabled;
+} probe = {PROBE_IDLE, 0, 0, PROBE_MIN_INTERVAL_MS, 0, 0, 0};
+
+/*
+** Output flushing - When the program's line discipline flushes its output
+** (e.g., on Ctrl-C), whatever is still queued for the attached tty is stale.
+** The attach process is signalled to throw away what it has queued, and
+** pty reads are held off until it's done so that new output isn't thrown
+** away with it.
+*/
+#define FLUSH_TIMEOUT_MS 100
+#define FLUSH_CHECK_MS 10
+
+static pid_t attach_pid = -1;
+static int flushing = 0;
+static uint32_t flush_deadline = 0;
+
+/* When a partial line held by the output filter should be sent anyway */
+static uint32_t filter_deadline = 0;
+
+/* Set by SIGUSR2 to log the output filter's counters */
+static volatile sig_atomic_t report_requested = 0;
+
+/* Milliseconds from start until the program was started and whether that
+** still needs to be reported */
+static uint32_t spawn_ms = 0;
+static int startup_pending = 0;
 
 #ifdef REPORT_BYTES_DROPPED
 int bytes_dropped = 0;
 #endif
 
+/* Milliseconds on a clock that wraps. Compare with time_reached(). */
 static uint32_t now()
 {
     static uint32_t counter = 0;
     struct timespec tp;
     if (clock_gettime(CLOCK_MONOTONIC, &tp) < 0)
-        return counter++;
-    return (uint32_t) tp.tv_sec;
+        return counter += 1000;
+    return (uint32_t) tp.tv_sec * 1000u + (uint32_t) (tp.tv_nsec / 1000000);
+}
+
+static int time_reached(uint32_t when, uint32_t current)
+{
+    return (int32_t) (current - when) >= 0;
 }
 
 /* Signal */
@@ -85,11 +152,107 @@ static void die(int sig)
     exit(EXIT_FAILURE);
 }
 
+/* Send a message made by snprintf to the client. Messages that were truncated
+** are cut to fit the buffer. The return code of write is ignored, since the
+** message gets dropped like any other output. */
+static ssize_t write_message(const char *str, int len, size_t size)
+{
+    if (len < 0)
+        return -1;
+    if ((size_t) len >= size)
+        len = (int) size - 1;
+    return write(client_fd, str, (size_t) len);
+}
+
+static uint32_t ms_since_start()
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint32_t) ((tp.tv_sec - start_time.tv_sec) * 1000 +
+                       (tp.tv_nsec - start_time.tv_nsec) / 1000000);
+}
+
+#ifdef POSIX_SPAWN_SETSID
+/* Create the pty and start the program with posix_spawn. This avoids
+** copying the master's page tables like forkpty() does, which is noticeable
+** at boot on slow systems. */
+static int spawn_pty(char **argv)
+{
+    extern char **environ;
+
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0)
+        return -1;
+
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    /* Hold the slave open until the program has it so that reads from the
+    ** master don't see a hangup. */
+    const char *slave_name = ptsname(fd);
+    int slave = slave_name ? open(slave_name, O_RDWR | O_NOCTTY | O_CLOEXEC) : -1;
+    if (slave < 0) {
+        close(fd);
+        return -1;
+    }
+
+    /* The program opens the slave after setsid() so that it becomes the
+    ** controlling terminal. */
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, slave_name, O_RDWR, 0);
+    posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDERR_FILENO);
+
+    /* Hold off SIGCHLD so that a failed exec can be reported. The program
+    ** gets the original signal mask. */
+    sigset_t mask, orig_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &orig_mask);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &orig_mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK);
+
+    int rc = posix_spawnp(&the_pty.pid, *argv, &actions, &attr, argv, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(slave);
+
+    /* SIGCHLD stays blocked on errors so that the caller can report them
+    ** before the failed child's exit gets handled */
+    if (rc != 0) {
+        close(fd);
+        spawn_failed = 1;
+        errno = rc;
+        return -1;
+    }
+
+    the_pty.fd = fd;
+    sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+    return 0;
+}
+#endif
+
 /* Initialize the pty structure. */
 static int init_pty(char **argv)
 {
     memset(&the_pty.ws, 0, sizeof(struct winsize));
 
+    /* When replaying a trace, a feeder process stands in for the program */
+    if (argv == NULL) {
+        the_pty.pid = replay_forkpty(&the_pty.fd);
+        return the_pty.pid < 0 ? -1 : 0;
+    }
+
+#ifdef POSIX_SPAWN_SETSID
+    return spawn_pty(argv);
+#else
     /* Create the pty process */
     the_pty.pid = forkpty(&the_pty.fd, NULL, NULL, NULL);
     if (the_pty.pid < 0)
@@ -105,32 +268,121 @@ static int init_pty(char **argv)
     }
     /* Parent.. Finish up and return */
     return 0;
+#endif
 }
 
-/* Process activity on the pty - Input and terminal changes are sent out to
-** the attached clients. If the pty goes away, we die. */
-static void pty_activity()
+/* Send how long it took to start the program and get its first output */
+static void report_startup()
 {
-    unsigned char buf[BUFSIZE];
-    ssize_t len;
+    char str[96];
+    int n = snprintf(str, sizeof(str),
+                     "[nbtty: program started at %u ms, first output at %u ms]\r\n",
+                     spawn_ms, ms_since_start());
+    write_message(str, n, sizeof(str));
+    startup_pending = 0;
+}
+
+/* Space out the next request further, up to the limit */
+static void probe_back_off()
+{
+    probe.interval *= 2;
+    if (probe.interval > PROBE_MAX_INTERVAL_MS)
+        probe.interval = PROBE_MAX_INTERVAL_MS;
+}
 
-    size_t bytes_to_read = sizeof(buf);
-    if (poll_window_size)
-        bytes_to_read -= ANSI_MAX_RESPONSE_LEN;
+/* Handle a window size report from the client */
+static void probe_reply(int size_changed)
+{
+    if (!probe.sent) {
+        probe.disabled = 1;
+        probe.state = PROBE_IDLE;
+        return;
+    }
 
-    /* Read the pty activity */
-    len = read(the_pty.fd, buf, bytes_to_read);
+    /* Late replies count too since the terminal did answer */
+    if (size_changed)
+        probe.interval = PROBE_MIN_INTERVAL_MS;
+    else
+        probe_back_off();
 
-    /* Error -> die */
-    if (len <= 0)
-        exit(EXIT_FAILURE);
+    probe.state = PROBE_IDLE;
+    probe.next_time = now() + probe.interval;
+}
 
-    /* If we need to poll the window size, tack the request onto the buffer */
-    if (poll_window_size) {
-        len += ansi_size_request(&buf[len]);
-        poll_window_size = 0;
+/* Send the window size request if it's time. Returns how many milliseconds
+** until this should be called again or -1 if it doesn't need to be. */
+static int probe_service()
+{
+    uint32_t current = now();
+
+    if (probe.state == PROBE_SENT) {
+        if (!time_reached(probe.deadline, current))
+            return (int) (probe.deadline - current);
+
+        /* No reply. Try again unless the terminal just doesn't answer. */
+        if (++probe.retries > PROBE_MAX_RETRIES) {
+            probe_back_off();
+            probe.state = PROBE_IDLE;
+            probe.next_time = current + probe.interval;
+            return -1;
+        }
+        probe.state = PROBE_WANTED;
+    }
+
+    if (probe.state == PROBE_WANTED) {
+        int queued = 0;
+        if (ioctl(client_fd, TIOCOUTQ, &queued) == 0 && queued > 0)
+            return PROBE_QUEUE_CHECK_MS;
+
+        unsigned char request[ANSI_MAX_REQUEST_LEN];
+        size_t len = ansi_size_request(request);
+        ssize_t n = write(client_fd, request, len);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return PROBE_QUEUE_CHECK_MS;
+
+        probe.state = PROBE_SENT;
+        probe.sent = 1;
+        probe.deadline = current + PROBE_REPLY_TIMEOUT_MS;
+        return PROBE_REPLY_TIMEOUT_MS;
     }
 
+    return -1;
+}
+
+/* Start discarding output queued for the attached tty */
+static void flush_output()
+{
+    /* A partial line held by the output filter is stale too */
+    filter_discard();
+
+    if (attach_pid <= 1 || kill(attach_pid, SIGUSR1) < 0)
+        return;
+
+    flushing = 1;
+    flush_deadline = now() + FLUSH_TIMEOUT_MS;
+}
+
+/* Check if the attach process has finished flushing. Returns how many
+** milliseconds until this should be called again or -1 if not flushing. */
+static int flush_service()
+{
+    if (!flushing)
+        return -1;
+
+    int queued = 0;
+    uint32_t current = now();
+    if (time_reached(flush_deadline, current) ||
+            ioctl(client_fd, TIOCOUTQ, &queued) < 0 ||
+            queued == 0) {
+        flushing = 0;
+        return -1;
+    }
+    return FLUSH_CHECK_MS;
+}
+
+/* Send output to the client. Whatever doesn't fit is dropped. */
+static void client_write(const unsigned char *buf, ssize_t len)
+{
     ssize_t written = 0;
     int retries = 0;
     for (;;) {
@@ -166,6 +418,71 @@ static void pty_activity()
 #endif
 }
 
+/* Send a partial line that the output filter has held for too long. Returns
+** how many milliseconds until this should be called again or -1 if it
+** doesn't need to be. */
+static int filter_service()
+{
+    if (filter_held() == 0)
+        return -1;
+
+    uint32_t current = now();
+    if (!time_reached(filter_deadline, current))
+        return (int) (filter_deadline - current);
+
+    unsigned char buf[FILTER_MAX_HELD];
+    client_write(buf, filter_flush(buf));
+    return -1;
+}
+
+/* Process activity on the pty - Input and terminal changes are sent out to
+** the attached clients. If the pty goes away, we die. */
+static void pty_activity()
+{
+    unsigned char buf[BUFSIZE];
+    ssize_t len;
+
+    /* Read the pty activity */
+    len = read(the_pty.fd, buf, sizeof(buf));
+
+    /* Error -> die */
+    if (len <= 0)
+        exit(EXIT_FAILURE);
+
+    unsigned char *data = buf;
+    if (the_pty.packet_mode) {
+        if (buf[0] != TIOCPKT_DATA) {
+            if (buf[0] & TIOCPKT_FLUSHWRITE)
+                flush_output();
+            return;
+        }
+
+        data++;
+        len--;
+        if (len == 0)
+            return;
+    }
+
+    trace_record(TRACE_PTY_OUTPUT, data, len);
+    scrollback_append(data, len);
+
+    if (startup_pending)
+        report_startup();
+
+    if (filter_enabled()) {
+        unsigned char filtered[BUFSIZE + FILTER_MAX_HELD];
+        int was_holding = filter_held() > 0;
+        unsigned long lines = filter_lines();
+
+        /* Partial lines get their own time to finish */
+        client_write(filtered, filter_process(data, len, filtered));
+        if (filter_held() > 0 && (!was_holding || filter_lines() != lines))
+            filter_deadline = now() + FILTER_IDLE_MS;
+    } else {
+        client_write(data, len);
+    }
+}
+
 /* Process activity from a client. */
 static void client_activity()
 {
@@ -183,26 +500,50 @@ static void client_activity()
         return;
     }
 
-    /* Check if we should poll the window size */
-    if (memchr(buf, '\r', len) != NULL) {
-        uint32_t current_seconds = now();
+    trace_record(TRACE_USER_INPUT, buf, len);
 
-        /* poll the window size at most every 5 seconds */
-        if (next_poll_time - current_seconds > 5) {
-            poll_window_size = 1;
-            next_poll_time = current_seconds + 5;
-        }
+    /* Check if we should poll the window size */
+    if (memchr(buf, '\r', len) != NULL &&
+            probe.state == PROBE_IDLE &&
+            !probe.disabled &&
+            time_reached(probe.next_time, now())) {
+        probe.state = PROBE_WANTED;
+        probe.retries = 0;
     }
 
     /* Push out data to the program. */
     unsigned char output[BUFSIZE];
     size_t output_size;
-    if (ansi_process_input(buf, len, output, &output_size, &the_pty.ws))
+    int size_changed = ansi_process_input(buf, len, output, &output_size, &the_pty.ws);
+    if (size_changed) {
         ioctl(the_pty.fd, TIOCSWINSZ, &the_pty.ws);
+        trace_record_winsize(&the_pty.ws);
+    }
+    if (ansi_size_report_received())
+        probe_reply(size_changed);
     if (output_size > 0)
         write(the_pty.fd, output, output_size);
 }
 
+static void request_dump(int sig)
+{
+    (void) sig;
+    scrollback_dump_requested();
+    report_requested = 1;
+}
+
+/* Shorten the select timeout to ms if that's sooner */
+static void set_timeout(struct timeval **timeout, struct timeval *tv, int ms)
+{
+    if (ms < 0)
+        return;
+    if (*timeout == NULL || (*timeout)->tv_sec * 1000 + (*timeout)->tv_usec / 1000 > ms) {
+        tv->tv_sec = ms / 1000;
+        tv->tv_usec = (ms % 1000) * 1000;
+        *timeout = tv;
+    }
+}
+
 /* The master process - It watches over the pty process and the attached */
 /* clients. */
 static void master_process(char **argv)
@@ -212,14 +553,37 @@ static void master_process(char **argv)
     setsid();
 
     /* Create a pty in which the process is running. */
+    signal(SIGUSR1, SIG_DFL);
     signal(SIGCHLD, die);
     if (init_pty(argv) < 0) {
-        if (errno == ENOENT)
+        if (spawn_failed && (errno == ENOENT || errno == EACCES || errno == ENOEXEC)) {
+            /* Report this like the forkpty() child does */
+            char str[256];
+            int n = snprintf(str, sizeof(str), EOS "Could not execute %s: %s\r\n",
+                             *argv, strerror(errno));
+            write_message(str, n, sizeof(str));
+            exit(127);
+        } else if (spawn_failed)
+            err(EXIT_FAILURE, "posix_spawn");
+        else if (errno == ENOENT)
             errx(EXIT_FAILURE, "Could not find a pty.");
         else
             err(EXIT_FAILURE, "init_pty");
     }
 
+    /* Packet mode reports when the program's output gets flushed */
+    int on = 1;
+    if (argv && ioctl(the_pty.fd, TIOCPKT, &on) == 0)
+        the_pty.packet_mode = 1;
+
+    if (report_startup_time) {
+        spawn_ms = ms_since_start();
+        startup_pending = 1;
+    }
+
+    /* The first probe is due right away. Times wrap, so 0 won't do. */
+    probe.next_time = now();
+
     /* Set up some signals. */
     signal(SIGPIPE, SIG_IGN);
     signal(SIGXFSZ, SIG_IGN);
@@ -228,6 +592,7 @@ static void master_process(char **argv)
     signal(SIGTTOU, SIG_IGN);
     signal(SIGINT, die);
     signal(SIGTERM, die);
+    signal(SIGUSR2, request_dump);
 
     /* Make sure stdin/stdout/stderr point to /dev/null. We are now a
     ** daemon. */
@@ -244,16 +609,62 @@ static void master_process(char **argv)
         fd_set readfds;
         FD_ZERO(&readfds);
         FD_SET(client_fd, &readfds);
-        FD_SET(the_pty.fd, &readfds);
+        int flush_ms = flush_service();
+        if (flush_ms < 0)
+            FD_SET(the_pty.fd, &readfds);
         int highest_fd = client_fd > the_pty.fd ? client_fd : the_pty.fd;
+        int scrollback_fd = scrollback_listen_fd();
+        if (scrollback_fd >= 0) {
+            FD_SET(scrollback_fd, &readfds);
+            if (scrollback_fd > highest_fd)
+                highest_fd = scrollback_fd;
+        }
+        fd_set writefds;
+        FD_ZERO(&writefds);
+        int scrollback_client = scrollback_client_fd();
+        if (scrollback_client >= 0) {
+            FD_SET(scrollback_client, &writefds);
+            if (scrollback_client > highest_fd)
+                highest_fd = scrollback_client;
+        }
+
+        scrollback_service();
+        if (report_requested) {
+            report_requested = 0;
+            filter_report();
+        }
+
+        struct timeval tv;
+        struct timeval *timeout = NULL;
+        set_timeout(&timeout, &tv, probe_service());
+        if (flush_ms < 0)
+            set_timeout(&timeout, &tv, filter_service());
+
+        /* Check back soon while the attach process is flushing */
+        set_timeout(&timeout, &tv, flush_ms);
+
+        /* Only wait long enough to see if there's time to compress output */
+        if (scrollback_pending())
+            set_timeout(&timeout, &tv, 0);
 
         /* Wait for something to happen. */
-        if (select(highest_fd + 1, &readfds, NULL, NULL, NULL) < 0) {
+        int rc = select(highest_fd + 1, &readfds, &writefds, NULL, timeout);
+        if (rc < 0) {
             if (errno == EINTR)
                 continue;
             exit(EXIT_FAILURE);
         }
 
+        /* Nothing to do, so catch up on compression */
+        if (rc == 0)
+            scrollback_compress();
+
+        /* Scrollback request? */
+        if (scrollback_fd >= 0 && FD_ISSET(scrollback_fd, &readfds))
+            scrollback_accept();
+        if (scrollback_client >= 0 && FD_ISSET(scrollback_client, &writefds))
+            scrollback_send();
+
         /* Activity on a client? */
         if (FD_ISSET(client_fd, &readfds))
             client_activity();
@@ -263,6 +674,8 @@ static void master_process(char **argv)
     }
 }
 
+/* Start the master process. If argv is NULL, the trace being replayed is
+** used in place of running a command. */
 int master_main(char **argv, int s)
 {
     ansi_reset_parser();
@@ -276,6 +689,11 @@ int master_main(char **argv, int s)
 
     client_fd = s;
 
+    /* The master signals flushes with SIGUSR1. Ignore them until the attach
+    ** process is ready. */
+    attach_pid = getpid();
+    signal(SIGUSR1, SIG_IGN);
+
     /* Fork off so we can daemonize and such */
     pid_t pid = fork();
     if (pid < 0) {
@@ -21,6 +21,9 @@
 
 #include <config.h>
 
+#include <sys/types.h>
+#include <time.h>
+
 /*
 ** The master sends a simple stream of text to the attaching clients, without
 ** any protocol. This might change back to the packet based protocol in the
@@ -33,7 +36,13 @@
 /* This hopefully moves to the bottom of the screen */
 #define EOS "\033[999H"
 
+/* When nbtty started and whether to report how long the program took to start */
+extern struct timespec start_time;
+extern int report_startup_time;
+
 int attach_main(int s, const char *ttypath, int wait_input);
 int master_main(char **argv, int s);
+int replay_main(const char *path, int realtime, unsigned long drain_rate);
+pid_t replay_forkpty(int *amaster);
 
 #endif
@@ -6,9 +6,18 @@ CONFIG -= qt
 SOURCES += main.c \
     attach.c \
     master.c \
-    ansi.c
+    ansi.c \
+    replay.c \
+    lz.c \
+    scrollback.c \
+    filter.c \
+    trace.c
 
 HEADERS += \
     config.h \
     nbtty.h \
-    ansi.h
+    ansi.h \
+    trace.h \
+    lz.h \
+    scrollback.h \
+    filter.h
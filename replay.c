@@ -0,0 +1,372 @@
+/*
+    nbtty - A subset of dtach that makes the terminal nonblocking
+    Copyright (C) 2017 Frank Hunleth
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "nbtty.h"
+#include "trace.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+/*
+ * Replaying a trace runs the real master process. The command in the pty
+ * is replaced by a feeder process that writes the recorded pty output, and
+ * the attached terminal is replaced by a simulated tty that types the
+ * recorded user input and reads at a fixed drain rate. Both sides read the
+ * trace independently and pace themselves off their own start times.
+ *
+ * Without realtime, there are no times to keep input and output in order,
+ * so the feeder tells the simulated tty over the sync sockets when it gets
+ * to each input record and waits until the input has been typed. Each side
+ * waits for the master to read what it wrote before handing over.
+ */
+static const char *trace_path = NULL;
+static int replay_realtime = 1;
+static int sync_fds[2] = { -1, -1 }; /* tty's end, feeder's end */
+
+static uint64_t elapsed_usec(const struct timespec *start)
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64_t) (tp.tv_sec - start->tv_sec) * 1000000 +
+           (tp.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static uint64_t record_usec(const struct trace_record *rec)
+{
+    return (uint64_t) rec->sec * 1000000 + rec->usec;
+}
+
+static void usec_to_timeval(uint64_t usec, struct timeval *tv)
+{
+    tv->tv_sec = usec / 1000000;
+    tv->tv_usec = usec % 1000000;
+}
+
+static int write_all(int fd, const unsigned char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Throw away anything the master sent to the "pty". If timeout is
+** non-NULL, wait up to that long for it to show up. */
+static void discard_input(int fd, struct timeval *timeout)
+{
+    for (;;) {
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(fd, &readfds);
+        int rc = select(fd + 1, &readfds, NULL, NULL, timeout);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return;
+
+        unsigned char buf[BUFSIZE];
+        if (read(fd, buf, sizeof(buf)) <= 0)
+            return;
+        if (timeout && timeout->tv_sec == 0 && timeout->tv_usec == 0)
+            return;
+    }
+}
+
+/* Check if the other end hasn't read everything written to fd yet */
+static int unread(int fd)
+{
+    int queued = 0;
+    return ioctl(fd, TIOCOUTQ, &queued) == 0 && queued > 0;
+}
+
+/* Have the simulated tty type the next input and wait for it to finish */
+static void sync_input(int fd)
+{
+    struct timeval tv;
+    while (unread(fd)) {
+        usec_to_timeval(1000, &tv);
+        discard_input(fd, &tv);
+    }
+
+    unsigned char token = 0;
+    if (write(sync_fds[1], &token, 1) != 1)
+        return;
+
+    for (;;) {
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(fd, &readfds);
+        FD_SET(sync_fds[1], &readfds);
+        int highest_fd = fd > sync_fds[1] ? fd : sync_fds[1];
+        int rc = select(highest_fd + 1, &readfds, NULL, NULL, NULL);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0)
+            return;
+
+        if (FD_ISSET(sync_fds[1], &readfds)) {
+            if (read(sync_fds[1], &token, 1) < 0 && errno == EINTR)
+                continue;
+            return;
+        }
+
+        usec_to_timeval(0, &tv);
+        discard_input(fd, &tv);
+    }
+}
+
+/* The feeder stands in for the program running in the pty. */
+static void feed_trace(int fd)
+{
+    int trace = trace_open_replay(trace_path);
+    if (trace < 0)
+        _exit(EXIT_FAILURE);
+
+    if (sync_fds[0] >= 0)
+        close(sync_fds[0]);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct trace_record rec;
+    unsigned char data[BUFSIZE];
+    while (trace_read(trace, &rec, data) > 0) {
+        if (rec.type == TRACE_USER_INPUT && !replay_realtime)
+            sync_input(fd);
+        if (rec.type != TRACE_PTY_OUTPUT)
+            continue;
+
+        /* Keep the master from blocking on writes to us */
+        struct timeval tv;
+        usec_to_timeval(0, &tv);
+        discard_input(fd, &tv);
+
+        if (replay_realtime) {
+            uint64_t now;
+            while ((now = elapsed_usec(&start)) < record_usec(&rec)) {
+                usec_to_timeval(record_usec(&rec) - now, &tv);
+                discard_input(fd, &tv);
+            }
+        }
+
+        if (write_all(fd, data, rec.len) < 0)
+            break;
+    }
+    close(trace);
+
+    /* Let the master read everything and then see EOF just like when the
+    ** program exits. It closes its end when it's done. */
+    shutdown(fd, SHUT_WR);
+    discard_input(fd, NULL);
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * Start the feeder in place of forkpty(). Returns the feeder's pid and
+ * sets *amaster to the master's end of the connection.
+ */
+pid_t replay_forkpty(int *amaster)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    } else if (pid == 0) {
+        close(sv[0]);
+        feed_trace(sv[1]);
+    }
+
+    close(sv[1]);
+    *amaster = sv[0];
+    return pid;
+}
+
+/* Read ahead to the next user input record while totalling pty output */
+static int next_input(int trace, struct trace_record *rec, unsigned char *data,
+                      uint64_t *output_bytes)
+{
+    while (trace_read(trace, rec, data) > 0) {
+        if (rec->type == TRACE_USER_INPUT)
+            return 1;
+        if (rec->type == TRACE_PTY_OUTPUT)
+            *output_bytes += rec->len;
+    }
+    return 0;
+}
+
+/**
+ * Replay a trace through the master. If realtime is 0, the trace is
+ * replayed as fast as possible. The simulated tty reads at most
+ * drain_rate bytes/second or as fast as possible if drain_rate is 0.
+ */
+int replay_main(const char *path, int realtime, unsigned long drain_rate)
+{
+    trace_path = path;
+    replay_realtime = realtime;
+
+    int trace = trace_open_replay(path);
+    if (trace < 0)
+        err(EXIT_FAILURE, "%s", path);
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        err(EXIT_FAILURE, "socketpair");
+    if (!realtime && socketpair(AF_UNIX, SOCK_STREAM, 0, sync_fds) < 0)
+        err(EXIT_FAILURE, "socketpair");
+
+    if (master_main(NULL, sv[0]) != 0)
+        return 1;
+
+    close(sv[0]);
+    int s = sv[1];
+    int sync_fd = sync_fds[0];
+    if (sync_fd >= 0)
+        close(sync_fds[1]);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint64_t output_bytes = 0;
+    uint64_t delivered_bytes = 0;
+    uint64_t busy_until = 0;
+
+    /* Drain in 10 ms chunks to approximate a UART */
+    size_t chunk_size = drain_rate / 100;
+    if (chunk_size == 0)
+        chunk_size = 1;
+    else if (chunk_size > BUFSIZE)
+        chunk_size = BUFSIZE;
+
+    struct trace_record rec;
+    unsigned char data[BUFSIZE];
+    int have_input = next_input(trace, &rec, data, &output_bytes);
+
+    for (;;) {
+        uint64_t now = elapsed_usec(&start);
+
+        /* Type whatever is due */
+        while (have_input && realtime && record_usec(&rec) <= now) {
+            if (write_all(s, data, rec.len) < 0)
+                err(EXIT_FAILURE, "write");
+            have_input = next_input(trace, &rec, data, &output_bytes);
+        }
+
+        struct timeval tv;
+        struct timeval *timeout = NULL;
+        uint64_t wait_usec = UINT64_MAX;
+        if (have_input && realtime)
+            wait_usec = record_usec(&rec) - now;
+
+        /* The tty is busy sending the last chunk until busy_until */
+        size_t to_read = BUFSIZE;
+        if (drain_rate > 0) {
+            if (now < busy_until) {
+                to_read = 0;
+                if (busy_until - now < wait_usec)
+                    wait_usec = busy_until - now;
+            } else {
+                to_read = chunk_size;
+                busy_until = now;
+            }
+        }
+        if (wait_usec != UINT64_MAX) {
+            usec_to_timeval(wait_usec, &tv);
+            timeout = &tv;
+        }
+
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        if (to_read > 0)
+            FD_SET(s, &readfds);
+        if (sync_fd >= 0)
+            FD_SET(sync_fd, &readfds);
+        int highest_fd = s > sync_fd ? s : sync_fd;
+        if (select(highest_fd + 1, &readfds, NULL, NULL, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            err(EXIT_FAILURE, "select");
+        }
+
+        /* Without realtime, the feeder says when the next input is due */
+        if (sync_fd >= 0 && FD_ISSET(sync_fd, &readfds)) {
+            unsigned char token;
+            if (read(sync_fd, &token, 1) != 1) {
+                close(sync_fd);
+                sync_fd = -1;
+            } else {
+                if (have_input) {
+                    if (write_all(s, data, rec.len) < 0)
+                        err(EXIT_FAILURE, "write");
+                    have_input = next_input(trace, &rec, data, &output_bytes);
+
+                    while (unread(s)) {
+                        struct timeval tv;
+                        usec_to_timeval(1000, &tv);
+                        select(0, NULL, NULL, NULL, &tv);
+                    }
+                }
+                if (write_all(sync_fd, &token, 1) < 0)
+                    err(EXIT_FAILURE, "write");
+            }
+        }
+
+        if (FD_ISSET(s, &readfds)) {
+            unsigned char buf[BUFSIZE];
+            ssize_t len = read(s, buf, to_read);
+            if (len < 0 && errno == EINTR)
+                continue;
+            if (len <= 0)
+                break;
+
+            delivered_bytes += len;
+            if (drain_rate > 0)
+                busy_until += (uint64_t) len * 1000000 / drain_rate;
+        }
+    }
+
+    double seconds = elapsed_usec(&start) / 1000000.0;
+    while (have_input)
+        have_input = next_input(trace, &rec, data, &output_bytes);
+    close(trace);
+
+    fprintf(stderr, "nbtty: replayed %s in %.3f s: %llu bytes of output, %llu delivered\n",
+            path, seconds,
+            (unsigned long long) output_bytes,
+            (unsigned long long) delivered_bytes);
+    return 0;
+}
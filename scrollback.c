@@ -0,0 +1,457 @@
+/*
+    nbtty - A subset of dtach that makes the terminal nonblocking
+    Copyright (C) 2017 Frank Hunleth
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "nbtty.h"
+#include "lz.h"
+#include "scrollback.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define DEFAULT_DUMP_PATH "/tmp/nbtty-scrollback.txt"
+
+/*
+ * The scrollback keeps the most recent pty output. Output is copied into
+ * a staging block on the hot path. Full blocks get compressed when the
+ * master is idle, or when the other staging block fills first. Compressed
+ * blocks are kept in a list from oldest to newest, and the oldest ones are
+ * freed to stay under the memory limit.
+ *
+ * Blocks are numbered in the order that they fill. Socket clients are sent
+ * one block at a time with non-blocking writes, so a slow client never
+ * holds up the master. If the block a client needs is freed in the
+ * meantime, it skips ahead to the oldest one left.
+ */
+struct scrollback_block {
+    struct scrollback_block *next;
+    uint32_t seq;
+    /* Size when compressed or 0 if stored as is */
+    uint16_t compressed_len;
+    uint16_t len;
+    unsigned char data[];
+};
+
+struct scrollback {
+    /* Memory limit for compressed blocks */
+    size_t max_compressed;
+    size_t compressed_used;
+
+    struct scrollback_block *oldest;
+    struct scrollback_block *newest;
+
+    /* Output is copied into active. When it fills, it's swapped with full
+    ** until it can be compressed. */
+    unsigned char *active;
+    size_t active_len;
+    unsigned char *full;
+    int full_pending;
+
+    /* Block numbers of the full staging block and of active */
+    uint32_t full_seq;
+    uint32_t next_seq;
+
+    /* Scratch space for compressing and decompressing blocks */
+    unsigned char *scratch;
+
+    int listen_fd;
+    const char *dump_path;
+};
+static struct scrollback scrollback = {0, 0, NULL, NULL, NULL, 0, NULL, 0, 0, 0, NULL, -1, NULL};
+
+/* The socket client being sent the scrollback */
+struct scrollback_client {
+    int fd;
+    /* The block being sent and how far into it */
+    uint32_t seq;
+    size_t offset;
+
+    /* Copy of the block being sent if it's one of the compressed ones */
+    unsigned char *block;
+    size_t block_len;
+    uint32_t block_seq;
+    int block_valid;
+};
+static struct scrollback_client client = {-1, 0, 0, NULL, 0, 0, 0};
+
+static volatile sig_atomic_t dump_requested = 0;
+
+static int write_all(int fd, const unsigned char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int listen_on(const char *path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* Clean up after a previous run, but don't remove anything else */
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Enable the scrollback with a limit of max_size bytes of RAM. If
+ * socket_path isn't NULL, the scrollback can be read by connecting to it.
+ * SIGUSR2 writes it to dump_path.
+ */
+int scrollback_init(size_t max_size, const char *socket_path, const char *dump_path)
+{
+    /* Two staging blocks, the scratch and client blocks and at least one
+    ** compressed one */
+    if (max_size < 5 * SCROLLBACK_BLOCK_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    scrollback.active = malloc(SCROLLBACK_BLOCK_SIZE);
+    scrollback.full = malloc(SCROLLBACK_BLOCK_SIZE);
+    scrollback.scratch = malloc(SCROLLBACK_BLOCK_SIZE);
+    client.block = malloc(SCROLLBACK_BLOCK_SIZE);
+    if (!scrollback.active || !scrollback.full || !scrollback.scratch || !client.block)
+        return -1;
+
+    scrollback.max_compressed = max_size - 4 * SCROLLBACK_BLOCK_SIZE;
+    scrollback.dump_path = dump_path ? dump_path : DEFAULT_DUMP_PATH;
+
+    if (socket_path) {
+        scrollback.listen_fd = listen_on(socket_path);
+        if (scrollback.listen_fd < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Compress the full staging block if there is one.
+ */
+void scrollback_compress()
+{
+    if (!scrollback.full_pending)
+        return;
+    scrollback.full_pending = 0;
+
+    /* Only keep the compressed version if it's smaller */
+    size_t len = lz_compress(scrollback.full, SCROLLBACK_BLOCK_SIZE,
+                             scrollback.scratch, SCROLLBACK_BLOCK_SIZE - 1);
+    const unsigned char *data = len ? scrollback.scratch : scrollback.full;
+    size_t stored_len = len ? len : SCROLLBACK_BLOCK_SIZE;
+
+    size_t block_size = sizeof(struct scrollback_block) + stored_len;
+    while (scrollback.oldest &&
+            scrollback.compressed_used + block_size > scrollback.max_compressed) {
+        struct scrollback_block *oldest = scrollback.oldest;
+        scrollback.oldest = oldest->next;
+        if (scrollback.oldest == NULL)
+            scrollback.newest = NULL;
+        scrollback.compressed_used -= sizeof(struct scrollback_block) +
+                                      (oldest->compressed_len ? oldest->compressed_len : oldest->len);
+        free(oldest);
+    }
+
+    struct scrollback_block *block = malloc(block_size);
+    if (block == NULL)
+        return;
+
+    block->next = NULL;
+    block->seq = scrollback.full_seq;
+    block->compressed_len = (uint16_t) len;
+    block->len = SCROLLBACK_BLOCK_SIZE;
+    memcpy(block->data, data, stored_len);
+
+    if (scrollback.newest)
+        scrollback.newest->next = block;
+    else
+        scrollback.oldest = block;
+    scrollback.newest = block;
+    scrollback.compressed_used += block_size;
+}
+
+/**
+ * Save output to the scrollback. This only copies so that it's cheap
+ * enough to call on every read from the pty.
+ */
+void scrollback_append(const unsigned char *data, size_t len)
+{
+    if (scrollback.active == NULL)
+        return;
+
+    while (len > 0) {
+        size_t n = SCROLLBACK_BLOCK_SIZE - scrollback.active_len;
+        if (n > len)
+            n = len;
+        memcpy(&scrollback.active[scrollback.active_len], data, n);
+        scrollback.active_len += n;
+        data += n;
+        len -= n;
+
+        if (scrollback.active_len == SCROLLBACK_BLOCK_SIZE) {
+            /* The master hasn't been idle, so compress the last one now */
+            scrollback_compress();
+
+            unsigned char *full = scrollback.active;
+            scrollback.active = scrollback.full;
+            scrollback.full = full;
+            scrollback.full_pending = 1;
+            scrollback.full_seq = scrollback.next_seq++;
+            scrollback.active_len = 0;
+        }
+    }
+}
+
+/**
+ * Return true if there's a block to compress when the master is idle.
+ */
+int scrollback_pending()
+{
+    return scrollback.full_pending;
+}
+
+/* Get the contents of a compressed block. Returns the length or -1 if it
+** can't be decompressed. */
+static int block_contents(const struct scrollback_block *block, unsigned char *buffer)
+{
+    if (block->compressed_len == 0) {
+        memcpy(buffer, block->data, block->len);
+        return block->len;
+    }
+
+    if (lz_decompress(block->data, block->compressed_len,
+                      buffer, SCROLLBACK_BLOCK_SIZE) != block->len)
+        return -1;
+    return block->len;
+}
+
+static void dump(int fd)
+{
+    for (struct scrollback_block *block = scrollback.oldest; block; block = block->next) {
+        int len = block_contents(block, scrollback.scratch);
+        if (len >= 0 && write_all(fd, scrollback.scratch, (size_t) len) < 0)
+            return;
+    }
+
+    if (scrollback.full_pending && write_all(fd, scrollback.full, SCROLLBACK_BLOCK_SIZE) < 0)
+        return;
+    write_all(fd, scrollback.active, scrollback.active_len);
+}
+
+/* The number of the oldest block that's still around */
+static uint32_t oldest_seq()
+{
+    if (scrollback.oldest)
+        return scrollback.oldest->seq;
+    else if (scrollback.full_pending)
+        return scrollback.full_seq;
+    else
+        return scrollback.next_seq;
+}
+
+/* Find what to send the client next. Returns the length of the block
+** being sent and sets *data. */
+static size_t client_block(const unsigned char **data)
+{
+    for (;;) {
+        if (client.seq < oldest_seq()) {
+            /* Freed while sending, so skip ahead */
+            client.seq = oldest_seq();
+            client.offset = 0;
+        }
+
+        if (client.seq == scrollback.next_seq) {
+            *data = scrollback.active;
+            return scrollback.active_len;
+        }
+
+        if (scrollback.full_pending && client.seq == scrollback.full_seq) {
+            *data = scrollback.full;
+            return SCROLLBACK_BLOCK_SIZE;
+        }
+
+        if (!client.block_valid || client.block_seq != client.seq) {
+            const struct scrollback_block *block = scrollback.oldest;
+            while (block && block->seq != client.seq)
+                block = block->next;
+
+            int len = block ? block_contents(block, client.block) : -1;
+            if (len < 0) {
+                /* Lost, so go on to the next one */
+                client.seq++;
+                client.offset = 0;
+                continue;
+            }
+            client.block_len = (size_t) len;
+            client.block_seq = client.seq;
+            client.block_valid = 1;
+        }
+
+        *data = client.block;
+        return client.block_len;
+    }
+}
+
+static void client_close()
+{
+    close(client.fd);
+    client.fd = -1;
+    client.block_valid = 0;
+}
+
+/**
+ * Return the listening socket's file descriptor or -1 if there isn't one
+ * or a client is still being served.
+ */
+int scrollback_listen_fd()
+{
+    return client.fd < 0 ? scrollback.listen_fd : -1;
+}
+
+/**
+ * Return the file descriptor of the client being sent the scrollback or -1.
+ * Call scrollback_send() when it's writable.
+ */
+int scrollback_client_fd()
+{
+    return client.fd;
+}
+
+/**
+ * Accept a client connecting to the socket. It's sent everything up to the
+ * newest output and then disconnected.
+ */
+void scrollback_accept()
+{
+    int fd = accept4(scrollback.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    client.fd = fd;
+    client.seq = oldest_seq();
+    client.offset = 0;
+    client.block_valid = 0;
+}
+
+/**
+ * Send the client the next part of the scrollback without blocking.
+ */
+void scrollback_send()
+{
+    if (client.fd < 0)
+        return;
+
+    for (;;) {
+        const unsigned char *data;
+        size_t len = client_block(&data);
+        if (client.offset >= len) {
+            if (client.seq == scrollback.next_seq) {
+                /* Caught up */
+                client_close();
+                return;
+            }
+            client.seq++;
+            client.offset = 0;
+            continue;
+        }
+
+        ssize_t n = write(client.fd, data + client.offset, len - client.offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n <= 0) {
+            client_close();
+            return;
+        }
+        /* Give the master a chance to do other things */
+        client.offset += (size_t) n;
+        return;
+    }
+}
+
+/**
+ * Request a dump to a file. This is safe to call from a signal handler.
+ */
+void scrollback_dump_requested()
+{
+    dump_requested = 1;
+}
+
+/**
+ * Handle dump requests. Call this from the main loop.
+ */
+void scrollback_service()
+{
+    if (!dump_requested)
+        return;
+    dump_requested = 0;
+
+    if (scrollback.active == NULL)
+        return;
+
+    /* Write to a new file and move it into place so that whatever is at
+    ** dump_path, like a symlink, never gets written through */
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", scrollback.dump_path) >= (int) sizeof(tmp_path))
+        return;
+
+    int fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd < 0)
+        return;
+    fchmod(fd, 0644);
+    dump(fd);
+    close(fd);
+
+    if (rename(tmp_path, scrollback.dump_path) < 0)
+        unlink(tmp_path);
+}
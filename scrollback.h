@@ -0,0 +1,21 @@
+#ifndef SCROLLBACK_H
+#define SCROLLBACK_H
+
+#include <stdlib.h>
+
+/* Output is saved in blocks of this size and compressed when they fill */
+#define SCROLLBACK_BLOCK_SIZE 16384
+
+int scrollback_init(size_t max_size, const char *socket_path, const char *dump_path);
+void scrollback_append(const unsigned char *data, size_t len);
+int scrollback_pending();
+void scrollback_compress();
+
+int scrollback_listen_fd();
+void scrollback_accept();
+int scrollback_client_fd();
+void scrollback_send();
+void scrollback_dump_requested();
+void scrollback_service();
+
+#endif // SCROLLBACK_H
@@ -0,0 +1,160 @@
+#include "nbtty.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+/* File descriptor of the trace being recorded or -1 if not recording */
+static int trace_fd = -1;
+static struct timespec trace_start;
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Read exactly len bytes. Returns 0 on a clean EOF before any bytes. */
+static ssize_t read_full(int fd, unsigned char *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            return got == 0 ? 0 : -1;
+        got += n;
+    }
+    return (ssize_t) got;
+}
+
+/**
+ * Start recording a trace to path. The file is truncated if it exists.
+ */
+int trace_open(const char *path)
+{
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd < 0)
+        return -1;
+
+    if (write(trace_fd, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1) != sizeof(TRACE_MAGIC) - 1) {
+        trace_close();
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
+    return 0;
+}
+
+void trace_close()
+{
+    if (trace_fd >= 0) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+}
+
+/**
+ * Append a record to the trace. This is a no-op if not recording. The
+ * header and payload go out with one system call so that a trace that
+ * was cut short by a crash is still readable up to the last record.
+ */
+void trace_record(enum trace_type type, const void *data, size_t len)
+{
+    if (trace_fd < 0 || len > UINT16_MAX)
+        return;
+
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    if (tp.tv_nsec < trace_start.tv_nsec) {
+        tp.tv_sec--;
+        tp.tv_nsec += 1000000000;
+    }
+
+    unsigned char header[TRACE_HEADER_LEN];
+    put_le32(&header[0], (uint32_t) (tp.tv_sec - trace_start.tv_sec));
+    put_le32(&header[4], (uint32_t) ((tp.tv_nsec - trace_start.tv_nsec) / 1000));
+    header[8] = len & 0xff;
+    header[9] = (len >> 8) & 0xff;
+    header[10] = (unsigned char) type;
+
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = len;
+
+    /* Stop recording on errors rather than write a corrupt trace */
+    if (writev(trace_fd, iov, 2) != (ssize_t) (sizeof(header) + len))
+        trace_close();
+}
+
+void trace_record_winsize(const struct winsize *ws)
+{
+    unsigned char data[4];
+    data[0] = ws->ws_row & 0xff;
+    data[1] = (ws->ws_row >> 8) & 0xff;
+    data[2] = ws->ws_col & 0xff;
+    data[3] = (ws->ws_col >> 8) & 0xff;
+    trace_record(TRACE_WINSIZE, data, sizeof(data));
+}
+
+/**
+ * Open a trace for reading and check its magic. Returns the file
+ * descriptor or -1 on error.
+ */
+int trace_open_replay(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    unsigned char magic[sizeof(TRACE_MAGIC) - 1];
+    if (read_full(fd, magic, sizeof(magic)) != sizeof(magic) ||
+            memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Read the next record. The data buffer must hold at least BUFSIZE
+ * bytes. Returns 1 if a record was read, 0 at the end of the trace
+ * and -1 if the trace is corrupt.
+ */
+int trace_read(int fd, struct trace_record *rec, unsigned char *data)
+{
+    unsigned char header[TRACE_HEADER_LEN];
+    ssize_t n = read_full(fd, header, sizeof(header));
+    if (n <= 0)
+        return (int) n;
+
+    rec->sec = get_le32(&header[0]);
+    rec->usec = get_le32(&header[4]);
+    rec->len = header[8] | (header[9] << 8);
+    rec->type = header[10];
+    if (rec->len > BUFSIZE)
+        return -1;
+
+    if (rec->len > 0 && read_full(fd, data, rec->len) != rec->len)
+        return -1;
+
+    return 1;
+}
@@ -0,0 +1,43 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+
+/*
+ * Traces are a ttyrec-like sequence of records. The file starts with
+ * TRACE_MAGIC and each record has an 11 byte little endian header:
+ *
+ *   uint32 seconds since the trace started
+ *   uint32 microseconds
+ *   uint16 payload length
+ *   uint8  record type
+ *
+ * followed by the payload.
+ */
+#define TRACE_MAGIC "NBTR\001"
+#define TRACE_HEADER_LEN 11
+
+enum trace_type {
+    TRACE_PTY_OUTPUT = 1, /* bytes read from the pty */
+    TRACE_USER_INPUT = 2, /* bytes received from the tty */
+    TRACE_WINSIZE = 3     /* new window size (rows, cols as uint16) */
+};
+
+struct trace_record {
+    uint32_t sec;
+    uint32_t usec;
+    uint16_t len;
+    uint8_t type;
+};
+
+int trace_open(const char *path);
+void trace_close();
+void trace_record(enum trace_type type, const void *data, size_t len);
+void trace_record_winsize(const struct winsize *ws);
+
+int trace_open_replay(const char *path);
+int trace_read(int fd, struct trace_record *rec, unsigned char *data);
+
+#endif // TRACE_H